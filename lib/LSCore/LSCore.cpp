@@ -0,0 +1,106 @@
+// TeensyLS by Lonnie Headley, MIT License (see src/main.cpp)
+
+#include "LSCore.h"
+
+char *nextToken(char *&line) {
+  while (*line == ' ' || *line == '\t') { line++; }
+  char *ret = line;
+  while (*line != '\0' && *line != ' ' && *line != '\t') { line++; }
+  if (*line != '\0') { *line++ = '\0'; }
+  return ret;
+}
+
+int64_t parseFixed(const char *in, int digits) {
+  int64_t value = 0;
+  bool negative = false;
+  int fraction = -1; // digits seen after the point
+
+  for (; *in != '\0'; in++) {
+    char c = *in;
+    if (c == '-') {
+      negative = true;
+    } else if (c == '.') {
+      if (fraction == -1) { fraction = 0; }
+    } else if (c >= '0' && c <= '9') {
+      if (fraction >= digits) { continue; }
+      value = value * 10 + (c - '0');
+      if (fraction >= 0) { fraction++; }
+    }
+  }
+
+  for (int i = (fraction == -1 ? 0 : fraction); i < digits; i++) { value *= 10; }
+  return negative ? -value : value;
+}
+
+bool isNumber(const char *in, bool decimal) {
+  bool digits = false;
+  bool point = false;
+
+  if (*in == '-') { in++; }
+  for (; *in != '\0'; in++) {
+    if (*in >= '0' && *in <= '9') {
+      digits = true;
+    } else if (*in == '.' && decimal && !point) {
+      point = true;
+    } else {
+      return false;
+    }
+  }
+  return digits;
+}
+
+bool JobQueue::push(uint8_t type, long arg) {
+  if (full()) { return false; }
+  JobCommand &cmd = jobs_[(head_ + count_) % jobQueueSize];
+  cmd.type = type;
+  cmd.arg = arg;
+  count_++;
+  return true;
+}
+
+JobCommand &JobQueue::at(int index) {
+  return jobs_[(head_ + index) % jobQueueSize];
+}
+
+void JobQueue::pop() {
+  if (count_ == 0) { return; }
+  head_ = (head_ + 1) % jobQueueSize;
+  count_--;
+}
+
+long mergeMoves(JobQueue &queue, long position) {
+  long target = queue.at(0).arg;
+  while (queue.count() > 1 && queue.at(1).type == jobMove && target != position &&
+         (queue.at(1).arg > target) == (target > position) && queue.at(1).arg != target) {
+    queue.pop();
+    target = queue.at(0).arg;
+  }
+  return target;
+}
+
+bool CamProfile::add(int32_t angle, long position) {
+  if (count_ >= maxCamPoints || angle < 0) { return false; }
+  if (count_ > 0 && angle <= points_[count_ - 1].angle) { return false; }
+  points_[count_].angle = angle;
+  points_[count_].position = position;
+  count_++;
+  return true;
+}
+
+// the pass only moves forward through the table so the segment is remembered between calls
+// and normally costs nothing to find
+long CamProfile::position(int32_t angle) {
+  if (angle <= points_[0].angle) { return points_[0].position; }
+  if (angle >= points_[count_ - 1].angle) { return points_[count_ - 1].position; }
+
+  while (angle < points_[segment_].angle) { segment_--; }
+  while (angle >= points_[segment_ + 1].angle) { segment_++; }
+
+  const CamPoint &a = points_[segment_];
+  const CamPoint &b = points_[segment_ + 1];
+  return a.position + ((int64_t)(angle - a.angle) * (b.position - a.position)) / (b.angle - a.angle);
+}
+
+int32_t camAngle(int32_t progress, int64_t startPulses, int numStarts) {
+  return progress - startPulses / numStarts;
+}
@@ -0,0 +1,89 @@
+// TeensyLS by Lonnie Headley, MIT License (see src/main.cpp)
+//
+// the parts of the firmware that don't touch the hardware. kept free of Arduino so they can be
+// built into the native unit tests as well as the sketch
+
+#ifndef LSCORE_H
+#define LSCORE_H
+
+#include <stdint.h>
+
+//--------------------------------------------
+// Command parsing
+//--------------------------------------------
+
+// split the next space separated token off the front of line in place. returns "" at the end
+char *nextToken(char *&line);
+
+// parse a decimal string to an integer scaled by 10^digits without going through float
+int64_t parseFixed(const char *in, int digits);
+
+// true for a plain number - optional sign, at least one digit and, for decimal, at most one point
+bool isNumber(const char *in, bool decimal);
+
+//--------------------------------------------
+// Job queue
+//--------------------------------------------
+#define jobQueueSize  32
+
+#define jobThread     1 // threading pass, arg = direction (0 = left, 1 = right)
+#define jobMove       2 // feed move, arg = position in steps
+#define jobDwell      3 // arg = ms
+#define jobCross      4 // relative cross slide move, arg = X steps
+
+struct JobCommand {
+  uint8_t type;
+  long arg;
+};
+
+// fixed size ring buffer, nothing is allocated
+class JobQueue {
+  public:
+    bool push(uint8_t type, long arg);
+    JobCommand &at(int index); // 0 is the command being run
+    void pop();
+    void clear() { count_ = 0; }
+    int count() const { return count_; }
+    bool full() const { return count_ >= jobQueueSize; }
+
+  private:
+    JobCommand jobs_[jobQueueSize];
+    int head_ = 0;
+    int count_ = 0;
+};
+
+// look ahead from a move at the head of the queue - moves that carry on in the same direction are
+// popped so they run through without stopping. returns the position to feed to
+long mergeMoves(JobQueue &queue, long position);
+
+//--------------------------------------------
+// Cam profile
+//--------------------------------------------
+#define maxCamPoints  64
+
+struct CamPoint {
+  int32_t angle;  // spindle pulses from the start of the pass, increasing
+  long position;  // steps from the start of the pass, in the direction of the pass
+};
+
+// carriage position against spindle angle, piecewise linear in integer math
+class CamProfile {
+  public:
+    bool add(int32_t angle, long position); // angles must increase
+    long position(int32_t angle);           // clamped to the first and last points
+    bool done(int32_t angle) const { return angle >= points_[count_ - 1].angle; }
+    void clear() { count_ = 0; segment_ = 0; }
+    int count() const { return count_; }
+    const CamPoint &point(int index) const { return points_[index]; }
+
+  private:
+    CamPoint points_[maxCamPoints];
+    int count_ = 0;
+    int segment_ = 0; // last segment used
+};
+
+// profile angle for the spindle pulses since a pass started. later starts of a multi start
+// thread run the same profile shifted round by their share of the revolution
+int32_t camAngle(int32_t progress, int64_t startPulses, int numStarts);
+
+#endif
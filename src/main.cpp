@@ -26,15 +26,16 @@ SOFTWARE.
 */
 
 #include <Arduino.h>
+#include <stddef.h>
 #include <EEPROM.h>
 #include <Bounce.h>
 #include <elapsedMillis.h>
 #include <AccelStepper.h>
 #include <Encoder.h>
 #include <EasyNextionLibrary.h>
+#include <LSCore.h>
 
 bool clock60hz;
-elapsedMillis ellapsed500ms;
 
 /*elapsedMicros loopTime;
 int loopTimeMax;
@@ -54,13 +55,20 @@ int loopTimeAvg;*/
 #define btnLeftOut    5
 #define btnRightOut   6
 #define switchIn      7
+#define powerSense    22 // low when the supply ahead of the hold-up capacitor drops. pulled up if not fitted
 
 #define drvStep       9
 #define drvDirection  10
 
+#define xDrvStep      11
+#define xDrvDirection 12
+
 #define spindleA      16
 #define spindleB      17
 
+#define scaleA        14
+#define scaleB        15
+
 Bounce knobA(knobAIn, 15);
 Bounce knobB(knobBIn, 15);
 Bounce btnKnob(btnKnobIn, 10);
@@ -105,6 +113,11 @@ void updateIO();
 #define varSPMM       3
 #define varAccel      4
 #define varSteprate   5
+#define varBacklash   6
+#define varXSPMM      7
+#define varXRetract   8
+#define varTaper      9
+#define varScale      10
 
 EasyNex nex(Serial5);
 
@@ -116,7 +129,7 @@ int returnPage;
 
 String unitString(bool spell);
 String floatToString(float in);
-String unitsToString(float in);
+String stepsToString(long in);
 String positionString();
 String feedString();
 String rpmString();
@@ -134,26 +147,50 @@ void updatePage(int page);
 //--------------------------------------------
 #define minTPI        4
 #define maxTPI        200
-#define maxMMS        10
-#define maxIPS        0.3937
-#define minMMPT       0.05
-#define maxMMPT       4
+#define maxFeed       600000 // um/min (10mm/s)
+#define minPitch      5      // 1/100 mm
+#define maxPitch      400    // 1/100 mm
+#define pitchStep     5      // 1/100 mm
 
 #define minAccel      20000
 #define minMaxSR      5000
+#define maxBacklash   2000
+#define maxTaper      1000 // um of X per mm of Z, 45 degrees
+#define maxStallError 400  // steps between the scale and the step count before it is a stall
 
 Encoder spindle(spindleA, spindleB);
+Encoder scale(scaleA, scaleB); // carriage linear scale or motor encoder, optional
 
 AccelStepper lsDriver(1, drvStep, drvDirection);
+AccelStepper xDriver(1, xDrvStep, xDrvDirection);
 
 int pulsesPerRev = 2880;
 int stepsPerMM = 800;
 int acceleration = 200000;
 int maxStepRate = 40000;
-
+int backlash = 0; // leadscrew/half-nut slack in steps, taken up by the planner on reversal
+
+// cross slide. X is slaved to Z (and so to the spindle while threading) so it follows
+// the same synchronization as the leadscrew
+int xStepsPerMM = 800;
+int xRetract = 0;  // steps to pull the tool out at the end of a threading pass, 0 = off
+int taper = 0;     // um of X per mm of Z, 0 = straight
+long xBase;        // X position at Z zero
+bool xRetracted;
+bool threadPending; // a pass is waiting for the cross slide before it starts
+
+// closed loop. the scale measures the carriage itself so it is compared against current,
+// which already has the backlash taken out
+int scaleCountsPerMM = 0; // 0 = no scale fitted, negative if it counts the other way
+long scaleOffset;         // steps, so the scale reads the same as current after a re-zero
+long stepOffset;          // carriage position minus the motor step count
+long positionError;       // measured - current
+
+// all machine state is kept in integer steps, spindle pulses or exact ratios.
+// units are only a presentation layer applied when displaying or parsing values
 bool jogAdjust = true;
-float jogFeedMulti = .1;
-float jogFeedSpeed = 1;
+int jogFeedMulti = 10;       // knob increment in 1/100 mm/s or 1/100 ipm
+long jogFeedRate = 60000;    // um/min, exact for both 0.01mm/s and 0.01ipm increments
 
 bool imperial;
 
@@ -161,40 +198,263 @@ float rpm;
 
 bool threading;
 
-float threadCount = 1.0;
+bool threadInTPI;            // true: threadValue is tpi, false: threadValue is pitch in 1/100 mm
+int threadValue = 100;
 int numStarts = 1;
 int start = 1;
-float startOffset;
+
+// steps per spindle pulse for the selected thread, reduced whenever the thread, starts or
+// setup changes so spindleToStep never has to work it out
+int64_t ratioNum = 800;
+int64_t ratioDen = 2880;    // includes numStarts
+int64_t startPulses;        // pulses into the revolution for the start selected, times numStarts
+
+struct ThreadSize {
+  const char *name;
+  bool tpi;
+  int value;                // tpi or pitch in 1/100 mm
+  int64_t pitchNum;         // exact pitch in mm, reduced
+  int64_t pitchDen;
+};
+
+constexpr int64_t gcd(int64_t a, int64_t b) { return b == 0 ? a : gcd(b, a % b); }
+
+constexpr ThreadSize metricSize(const char *name, int pitch) {
+  return { name, false, pitch, pitch / gcd(pitch, 100), 100 / gcd(pitch, 100) };
+}
+
+constexpr ThreadSize tpiSize(const char *name, int tpi) {
+  return { name, true, tpi, 254 / gcd(254, tpi * 10), tpi * 10 / gcd(254, tpi * 10) };
+}
+
+// ISO metric coarse and fine
+constexpr ThreadSize metricSizes[] = {
+  metricSize("M1", 25),        metricSize("M1.2", 25),      metricSize("M1.6", 35),
+  metricSize("M2", 40),        metricSize("M2.5", 45),      metricSize("M3", 50),
+  metricSize("M3.5", 60),      metricSize("M4", 70),        metricSize("M5", 80),
+  metricSize("M6", 100),       metricSize("M8x1", 100),     metricSize("M8", 125),
+  metricSize("M10x1", 100),    metricSize("M10x1.25", 125), metricSize("M10", 150),
+  metricSize("M12x1.25", 125), metricSize("M12x1.5", 150),  metricSize("M12", 175),
+  metricSize("M14x1.5", 150),  metricSize("M14", 200),      metricSize("M16x1.5", 150),
+  metricSize("M16", 200),      metricSize("M18x1.5", 150),  metricSize("M18", 250),
+  metricSize("M20x1.5", 150),  metricSize("M20", 250),      metricSize("M22x1.5", 150),
+  metricSize("M22", 250),      metricSize("M24x2", 200),    metricSize("M24", 300),
+  metricSize("M27x2", 200),    metricSize("M27", 300),      metricSize("M30x2", 200),
+  metricSize("M30", 350),      metricSize("M33x2", 200),    metricSize("M33", 350),
+  metricSize("M36x3", 300),    metricSize("M36", 400),
+};
+
+// UNC, UNF and BSW
+constexpr ThreadSize tpiSizes[] = {
+  tpiSize("#4 UNC", 40),       tpiSize("#4 UNF", 48),       tpiSize("#6 UNC", 32),
+  tpiSize("#6 UNF", 40),       tpiSize("#8 UNC", 32),       tpiSize("#8 UNF", 36),
+  tpiSize("#10 UNC", 24),      tpiSize("#10 UNF", 32),      tpiSize("1/4 UNC", 20),
+  tpiSize("1/4 UNF", 28),      tpiSize("1/4 BSW", 20),      tpiSize("5/16 UNC", 18),
+  tpiSize("5/16 UNF", 24),     tpiSize("5/16 BSW", 18),     tpiSize("3/8 UNC", 16),
+  tpiSize("3/8 UNF", 24),      tpiSize("3/8 BSW", 16),      tpiSize("7/16 UNC", 14),
+  tpiSize("7/16 UNF", 20),     tpiSize("7/16 BSW", 14),     tpiSize("1/2 UNC", 13),
+  tpiSize("1/2 UNF", 20),      tpiSize("1/2 BSW", 12),      tpiSize("9/16 UNC", 12),
+  tpiSize("9/16 UNF", 18),     tpiSize("9/16 BSW", 12),     tpiSize("5/8 UNC", 11),
+  tpiSize("5/8 UNF", 18),      tpiSize("5/8 BSW", 11),      tpiSize("3/4 UNC", 10),
+  tpiSize("3/4 UNF", 16),      tpiSize("3/4 BSW", 10),      tpiSize("7/8 UNC", 9),
+  tpiSize("7/8 UNF", 14),      tpiSize("7/8 BSW", 9),       tpiSize("1 UNC", 8),
+  tpiSize("1 UNF", 12),        tpiSize("1 BSW", 8),
+};
+
+#define numMetricSizes (int)(sizeof(metricSizes) / sizeof(metricSizes[0]))
+#define numTPISizes    (int)(sizeof(tpiSizes) / sizeof(tpiSizes[0]))
+
+const ThreadSize *threadEntry; // standard size selected, NULL for a custom pitch
 
 bool invertSpindle = true;
 int32_t currentSpindle;
 
-float current;
+long current;
 
-float leftStop;
 long leftSteps;
 bool leftStopOn;
 
-float rightStop;
 long rightSteps;
 bool rightStopOn;
 
 void updateMovement();
 void invertUnits();
-long unitsToStep(float in);
-long spindleToStep(float in);
+long stringToSteps(const char *in);
+long spindleToStep(int32_t in);
+void updateThreadRatio();
+void selectThreadSize(int dir);
 float stepsToUnits(long in);
+float feedStepRate();
+void planMove(long target, int preload = 0);
+void setPosition(long position);
+long taperOffset(long z);
+long crossSlideTarget();
+long measuredPosition();
+void correctPosition();
 void processThread();
 void processFeed();
 
+//--------------------------------------------
+// Cam defines/variables/functions
+//--------------------------------------------
+// a threading pass can follow a table of carriage position against spindle angle instead of
+// the fixed pitch. covers variable pitch, lead in/out ramps, oil grooves and multi-segment feeds.
+// the table and its interpolation are in lib/LSCore
+CamProfile cam;
+bool camEnabled;
+long camStepsPerRev;  // steepest segment, for the step rate check
+
+long passTravel(int32_t progress);
+void enableCam(bool on);
+String handleCam(const char *arg, char *&line, bool busy);
+String handleSetup(const char *cmd, const char *arg);
+
+//--------------------------------------------
+// Supervisor defines/variables/functions
+//--------------------------------------------
+#define faultNone       0
+#define faultFollowing  1 // carriage has fallen behind the spindle
+#define faultStepRate   2 // spindle needs more than maxStepRate
+#define faultOverrun    3 // motion pass came too late
+#define faultEncoder    4 // spindle jumped more than it physically can in one pass
+#define faultStall      5 // scale says the carriage isn't where the steps put it
+#define faultPower      6 // supply dropped, motion state has been saved
+
+#define maxFollowError  400     // steps
+#define followTimeout   250000  // us, allows the catch up at the start of a pass
+#define maxMotionGap    2000    // us between motion passes while threading
+
+long planTarget;        // last carriage target handed to the planner
+long stepRateRequired;  // steps/s the current spindle speed needs while threading
+int faultCode;
+
+void superviseMotion();
+void fault(int code);
+String faultString(int code);
+
 //--------------------------------------------
 // System defines/variables/functions
 //--------------------------------------------
 #define goodEepromValue 1984 // arbitrary value, just to check to see if eeprom has been written stored at least once
+#define eepromLayout    1    // bump when values are added, older layouts leave the new ones erased
 
 void eepromGet();
 void eepromPut();
 
+// motion state saved when the supply drops and restored at boot. kept in its own CRC checked
+// block of the (flash emulated) eeprom, away from the setup values
+#define snapshotAddress 64
+#define snapshotMagic   0x544C5332 // "TLS2"
+
+struct Snapshot {
+  uint32_t magic;
+  long position;
+  long slack;         // where the motor is in the backlash window, -backlash (pulling left) to 0
+  long leftSteps;
+  long rightSteps;
+  int32_t spindle;    // raw encoder count, keeps the thread phase against position
+  long xPosition;
+  long xBase;
+  long jogFeedRate;
+  int threadValue;
+  int threadSize;     // index into the table for threadInTPI, -1 = custom
+  int numStarts;
+  int start;
+  bool leftStopOn;
+  bool rightStopOn;
+  bool imperial;
+  bool threadInTPI;
+  bool xRetracted;
+  uint32_t crc;
+};
+
+#define powerRecoverTime 100 // ms the supply has to be back before a brown-out counts as over
+
+volatile bool powerLost;
+bool snapshotSaved; // taken this boot and not yet thrown away
+
+void powerFail();
+void checkPower();
+void snapshotPut();
+bool snapshotGet();
+void snapshotClear();
+uint32_t crc32(const uint8_t *data, size_t length);
+
+//--------------------------------------------
+// Job queue defines/variables/functions
+//--------------------------------------------
+// queue, job types and move merging are in lib/LSCore
+#define threadNone    -1
+
+JobQueue jobQueue;
+int jobPhase;
+bool jobRunning;
+bool jobSwitch; // enable switch position when the job was started
+int threadRequest = threadNone; // direction for processThread to start the next pass in
+
+void popJob();
+void abortJob();
+void processJob();
+
+//--------------------------------------------
+// Serial defines/variables/functions
+//--------------------------------------------
+#define serialLineLength 64
+
+char serialLine[serialLineLength + 1];
+int serialLength;
+bool pageDirty; // settings changed from serial, redraw the page when the nextion is free
+
+void readSerial();
+void handleCommand(char *line);
+void printStatus();
+void printStats();
+
+//--------------------------------------------
+// Scheduler defines/variables/functions
+//--------------------------------------------
+#define prioRealtime  0 // runs every pass, never skipped
+
+struct Task {
+  const char *name;
+  void (*run)();
+  uint8_t priority;   // lower runs first
+  uint32_t period;    // us, ignored for realtime tasks
+  uint32_t budget;    // us, longer runs count as an overrun
+  bool idleOnly;      // only run while the carriage is stopped and not threading
+  uint32_t lastRun;
+  uint32_t runs;
+  uint32_t overruns;
+  uint32_t maxTime;
+  uint32_t totalTime;
+};
+
+void taskMotion();
+void taskSupervisor();
+void taskPower();
+void taskRPM();
+void taskSerial();
+void taskNexListen();
+void taskNexUpdate();
+
+// the nextion tasks are idle only since writing to it while the stepper is moving causes jitter in stepping.
+// every other task needs a period or it would starve the ones below it
+Task tasks[] = {
+  // name         function        priority      period  budget  idle only
+  { "motion",     taskMotion,     prioRealtime, 0,      25,     false },
+  { "supervisor", taskSupervisor, prioRealtime, 0,      10,     false },
+  { "power",      taskPower,      prioRealtime, 0,      5,      false },
+  { "rpm",        taskRPM,        1,            500000, 50,     false },
+  { "serial",     taskSerial,     2,            1000,   200,    false },
+  { "nexlisten",  taskNexListen,  3,            1000,   2000,   true },
+  { "nexupdate",  taskNexUpdate,  4,            50000,  5000,   true },
+};
+
+#define numTasks (sizeof(tasks) / sizeof(tasks[0]))
+
+void runScheduler();
+void runTask(Task &task, uint32_t now);
+
 //--------------------------------------------
 // Setup
 //--------------------------------------------
@@ -213,6 +473,7 @@ void setup() {
   pinMode(btnLeftOut, OUTPUT);
   pinMode(btnRightOut, OUTPUT);
   pinMode(switchIn, INPUT_PULLUP);
+  pinMode(powerSense, INPUT_PULLUP);
 
   nex.begin(115200);
   Serial.begin(9600);
@@ -226,51 +487,132 @@ void setup() {
     eepromPut();
   }
   lsDriver.setAcceleration(acceleration);
+  xDriver.setAcceleration(acceleration);
+  if (snapshotGet()) { Serial.println("restored motion state after power loss"); }
+  updateThreadRatio();
+  attachInterrupt(digitalPinToInterrupt(powerSense), powerFail, FALLING);
   delay(2000);
   gotoPage(btnKnob.read() ? pageMenu : pageSetup);
 }
 
 void loop() {
-  static int32_t lastSpindle; 
+  runScheduler();
+}
+
+// realtime tasks run every pass. the slack after them goes to the single most urgent due
+// task so nothing else can add more than one task's worth of delay to the next motion pass
+void runScheduler() {
+  uint32_t now = micros();
+  bool idle = !lsDriver.isRunning() && !threading && !jobRunning;
+  Task *next = NULL;
+
+  for (unsigned int i = 0; i < numTasks; i++) {
+    Task &task = tasks[i];
+    if (task.priority == prioRealtime) {
+      runTask(task, now);
+    } else if (now - task.lastRun >= task.period && (idle || !task.idleOnly)) {
+      if (next == NULL || task.priority < next->priority) { next = &task; }
+    }
+  }
 
+  if (next != NULL) { runTask(*next, micros()); }
+}
+
+void runTask(Task &task, uint32_t now) {
+  task.run();
+
+  uint32_t time = micros() - now;
+  task.lastRun = now;
+  task.runs++;
+  task.totalTime += time;
+  if (time > task.maxTime) { task.maxTime = time; }
+  if (time > task.budget) { task.overruns++; }
+}
+
+void taskMotion() {
   updateIO();
   updateMovement();
+}
 
-  if (!lsDriver.isRunning() && !threading) {
-    if (ellapsed500ms > 500) {
-      ellapsed500ms = 0;
-      clock60hz = !clock60hz;
+void taskSupervisor() {
+  superviseMotion();
+}
 
-      rpm = ((currentSpindle - lastSpindle) / (float)pulsesPerRev) * 120;
-      lastSpindle = currentSpindle;
-    }
-    updateNextion(); //can't update the nextion while the stepper is moving. unfortunately there is still some delay that causes jitter in stepping
-  } 
+void taskPower() {
+  checkPower();
+}
+
+void taskRPM() {
+  static int32_t lastSpindle;
+  static uint32_t lastTime;
+  uint32_t now = micros();
+
+  clock60hz = !clock60hz;
+
+  rpm = ((currentSpindle - lastSpindle) / (float)pulsesPerRev) * (60000000.0f / (now - lastTime));
+  lastSpindle = currentSpindle;
+  lastTime = now;
+
+  // done here so the supervisor doesn't need float math every pass
+  long stepsPerRev = camEnabled ? camStepsPerRev : abs(spindleToStep(pulsesPerRev) - spindleToStep(0));
+  stepRateRequired = abs(rpm) * stepsPerRev / 60;
+}
+
+void taskSerial() {
+  readSerial();
+}
+
+void taskNexListen() {
+  nex.NextionListen();
+}
+
+void taskNexUpdate() {
+  if (pageDirty) {
+    pageDirty = false;
+    updatePage(currentPage);
+  }
+  updateNextion();
 }
 
 void updateMovement() {
   currentSpindle = (invertSpindle ? -spindle.read() : spindle.read());
   
-  switch (currentPage)
-  {
-  case pageMenu:
-  case pageJogFeed:
-    processFeed();
-    break;
-  case pageThreading:
-    processThread();
-    break;
-  default:
-    break;
+  if (jobRunning) {
+    processJob();
+  } else {
+    switch (currentPage)
+    {
+    case pageMenu:
+    case pageJogFeed:
+      processFeed();
+      break;
+    case pageThreading:
+      processThread();
+      break;
+    default:
+      break;
+    }
   }
 
   lsDriver.run();
-  current = stepsToUnits(lsDriver.currentPosition());
+
+  if (crossSlideTarget() != xDriver.targetPosition()) {
+    xDriver.setMaxSpeed(maxStepRate);
+    xDriver.moveTo(crossSlideTarget());
+  }
+  xDriver.run();
+
+  // the carriage sits somewhere inside the backlash window of the motor. it only moves
+  // once the motor has pushed through the slack so clamp it into that window
+  long motor = lsDriver.currentPosition() + stepOffset;
+  current = constrain(current, motor, motor + (long)backlash);
+
+  if (scaleCountsPerMM != 0) { correctPosition(); }
 }
 
 // update input and outputs
 void updateIO() {
-  float jFM;
+  long jFM;
 
     // using bounce library for smoother reading of cheapo encoder
   knobB.update();
@@ -281,32 +623,45 @@ void updateIO() {
       } else {
         knobValue--;
       }
-      if (!btnKnob.read() && !threading) {
+      // nothing the next pass depends on changes between the passes of a job either
+      if (!btnKnob.read() && !threading && !threadPending && !jobRunning) {
         switch (nex.currentPageId) {
           case pageMenu:
           case pageJogFeed:
-            jFM = (imperial ? jogFeedMulti / 60: jogFeedMulti);
-            jogFeedSpeed += (knobB.read() ? jFM : -jFM);
-            if (imperial) {
-              if (jogFeedSpeed < jFM) { jogFeedSpeed = jFM; }
-              if (jogFeedSpeed > maxIPS) { jogFeedSpeed = maxIPS; }
-            } else {
-              if (jogFeedSpeed < jFM) { jogFeedSpeed = jFM; }
-              if (jogFeedSpeed > maxMMS) { jogFeedSpeed = maxMMS; }
-            }
+            // 0.01ipm = 254um/min, 0.01mm/s = 600um/min
+            jFM = jogFeedMulti * (imperial ? 254 : 600);
+            jogFeedRate += (knobB.read() ? jFM : -jFM);
+            if (jogFeedRate < jFM) { jogFeedRate = jFM; }
+            if (jogFeedRate > maxFeed) { jogFeedRate = maxFeed; }
             break;
           case pageThreading:
             if (imperial) {
-              threadCount += knobB.read() ? 1 : -1;
-              if (threadCount < minTPI) { threadCount = minTPI; }
+              if (!threadInTPI) { // snap a metric pitch to the nearest tpi
+                threadValue = (2540 + threadValue / 2) / threadValue;
+                threadInTPI = true;
+              }
+              threadValue += knobB.read() ? 1 : -1;
+              if (threadValue < minTPI) { threadValue = minTPI; }
+              if (threadValue > maxTPI) { threadValue = maxTPI; }
             } else {
-              threadCount += knobB.read() ? 0.05 : -0.05;
-              if (threadCount < minMMPT) { threadCount = minMMPT; }
-              if (threadCount > maxMMPT) { threadCount = maxMMPT; }
+              if (threadInTPI) { // snap a tpi to the metric pitch step below it
+                threadValue = (2540 / threadValue) / pitchStep * pitchStep;
+                threadInTPI = false;
+              }
+              threadValue += knobB.read() ? pitchStep : -pitchStep;
+              if (threadValue < minPitch) { threadValue = minPitch; }
+              if (threadValue > maxPitch) { threadValue = maxPitch; }
             }
+            threadEntry = NULL;
+            updateThreadRatio();
             break;
         }
       }
+
+      // without the knob pressed the threading page steps through the standard sizes
+      if (btnKnob.read() && !threading && !threadPending && !jobRunning && nex.currentPageId == pageThreading) {
+        selectThreadSize(knobB.read() ? 1 : -1);
+      }
     }
   }
 
@@ -318,29 +673,27 @@ void updateIO() {
 
 void processThread() {
 
-  static float spindlePosition;
   static bool direction;
   static long threadNumber;
   static long target;
   static long positionOffset;
-  static long threadOffset;
+  static int32_t spindleOffset;
+  static bool camDone; // a cam pass ended with the button still held
+  bool jogging = switchEnable.read() && !jobRunning; // jobs always run between the stops
   
   // calculate the number of full rotations
-  threadNumber = floor(currentSpindle / pulsesPerRev);
-
-  // give us a number between 0.0 and 1.0 for the orientation of the spindle
-  spindlePosition = (currentSpindle % pulsesPerRev) / (float)pulsesPerRev;
+  threadNumber = currentSpindle / pulsesPerRev;
 
   if (threading) {
     if (direction) { // which way are we going. 0 = left, 1 = right.
-      // thread magic - calculate target position based on the current thread number,
-      // current spindle orientation, and add in the offset for the start selected
-      target = positionOffset - spindleToStep((threadNumber - threadOffset) + spindlePosition + startOffset);
+      // thread magic - calculate target position based on the spindle pulses since the
+      // revolution we started behind, and add in the offset for the start selected
+      target = positionOffset + passTravel(spindleOffset - currentSpindle);
 
       // since we are starting behind the actual thread to cut we have to restrict that movement
       if (target < positionOffset) { target = positionOffset; }
 
-      if (switchEnable.read()) {
+      if (jogging) {
         if (btnRight.read()) {
           // button is not pressed and we are jogging - turn off threading
           threading = 0;
@@ -352,12 +705,15 @@ void processThread() {
 
           // could have overshot so just bump the target to the exact end stop position
           target = rightSteps;
+
+          // pull the tool out on the same pass the stop is reached
+          xRetracted = true;
         }
       }
     } else {
-      target = positionOffset + spindleToStep((threadNumber - threadOffset) + spindlePosition + startOffset);
+      target = positionOffset - passTravel(spindleOffset - currentSpindle);
       if (target > positionOffset) { target = positionOffset; }
-      if (switchEnable.read()) {
+      if (jogging) {
         if (btnLeft.read()) {
           threading = 0;
         }
@@ -365,42 +721,73 @@ void processThread() {
         if (target <= leftSteps) {
           threading = 0;
           target = leftSteps;
+          xRetracted = true;
         }
       }
     }
 
+    // a cam profile ends the pass itself once the spindle is past its last point
+    if (camEnabled && cam.done(camAngle(spindleOffset - currentSpindle, startPulses, numStarts))) {
+      threading = false;
+      xRetracted = true;
+      camDone = !jobRunning;
+    }
+
     // turn threading mode off if the switch is turned off while none of the direction buttons are pressed
-    if (switchEnable.read() && btnLeft.read() && btnRight.read()) { threading = false; }
+    if (jogging && btnLeft.read() && btnRight.read()) { threading = false; }
   
+    // the slack is taken up during the revolution of lead in so the cut starts in phase
     lsDriver.setMaxSpeed(maxStepRate);
-    lsDriver.moveTo(target);
+    planMove(target, direction ? 1 : -1);
   } else {
     // threading mode is not on so we must check for user input
     // switch off - check for only a direction button press for jogging 
     // switch on - check for direction button press but the end stop must be enabled and the current position can't exceed it
-    if (switchEnable.read() ? !btnLeft.read() : (!btnLeft.read() && leftStopOn && lsDriver.currentPosition() > leftSteps)) {
-      // set up for a new thread operation
+    if (jobRunning) {
+      // the job queue starts the passes instead of the buttons
+      if (threadRequest != threadNone) {
+        direction = threadRequest;
+        threadPending = true;
+      }
+    } else if (camDone) {
+      // the button has to come up before it can start another pass
+      camDone = !btnLeft.read() || !btnRight.read();
+    } else if (switchEnable.read() ? !btnLeft.read() : (!btnLeft.read() && leftStopOn && current > leftSteps)) {
       direction = false;
-      threading = true;
-      threadOffset = threadNumber - 1; // fall back behind the current position by 1 thread
-      positionOffset = lsDriver.currentPosition(); // save the current position as the offset
-    } else if (switchEnable.read() ? !btnRight.read() : (!btnRight.read() && rightStopOn && lsDriver.currentPosition() < rightSteps)) {
+      threadPending = true;
+    } else if (switchEnable.read() ? !btnRight.read() : (!btnRight.read() && rightStopOn && current < rightSteps)) {
       direction = true;
-      threading = true;
-      threadOffset = threadNumber - 1;
-      positionOffset = lsDriver.currentPosition();
+      threadPending = true;
+    }
+
+    // put the tool back in and wait for the cross slide before starting the pass
+    if (threadPending) {
+      // the button (or job request) has to still be there when the pass starts, not just when it was made
+      if (jobRunning ? threadRequest == threadNone : (direction ? btnRight.read() : btnLeft.read())) {
+        threadPending = false;
+      } else {
+        xRetracted = false;
+      }
+      if (threadPending && xDriver.currentPosition() == crossSlideTarget()) {
+        // set up for a new thread operation
+        threadPending = false;
+        threadRequest = threadNone;
+        threading = true;
+        spindleOffset = (threadNumber - 1) * pulsesPerRev; // fall back behind the current position by 1 thread
+        positionOffset = current; // save the current position as the offset
+      }
     }
   }
 }
 
 void processFeed() {
-  lsDriver.setMaxSpeed(unitsToStep(jogFeedSpeed));
+  lsDriver.setMaxSpeed(feedStepRate());
 
   if (switchEnable.read()) {
     if (!btnLeft.read()) {
-      lsDriver.moveTo(lsDriver.currentPosition() - 1000);
+      planMove(current - 1000);
     } else if (!btnRight.read()) {
-      lsDriver.moveTo(lsDriver.currentPosition() + 1000);
+      planMove(current + 1000);
     } else {
       if (lsDriver.isRunning()) {
         lsDriver.stop();
@@ -408,52 +795,578 @@ void processFeed() {
     }
   } else {
     if (!btnLeft.read() && leftStopOn) {
-      lsDriver.moveTo(unitsToStep(leftStop));
+      planMove(leftSteps);
     } else if (!btnRight.read() && rightStopOn) {
-      lsDriver.moveTo(unitsToStep(rightStop));
+      planMove(rightSteps);
     }        
   }
 }
 
+// positions, stops, feed and thread are stored unit-free so switching is just a display change
 void invertUnits() {
-  if (imperial) {
-    imperial = false;
-    current = current * 25.4;
-    leftStop = leftStop * 25.4;
-    rightStop = rightStop * 25.4;
-    jogFeedSpeed = jogFeedSpeed * 25.4;
-    float t = (1 / threadCount) * 25.4;
-    threadCount = floor(t / 0.05) * 0.05;
-    if (threadCount > 4) { threadCount = 4; }
+  imperial = !imperial;
+}
 
+float stepsToUnits(long in) {
+  return in / (imperial ? stepsPerMM * 25.4 : stepsPerMM);
+}
+
+// convert spindle pulses to leadscrew steps with the exact thread ratio, including the
+// fraction of a revolution for the start selected. integer math only, this is the hot path
+long spindleToStep(int32_t in) {
+  return (((int64_t)in * numStarts + startPulses) * ratioNum) / ratioDen;
+}
+
+// call whenever the thread, starts, pulsesPerRev or stepsPerMM change
+void updateThreadRatio() {
+  int64_t num;
+  int64_t den;
+  if (threadEntry != NULL) {
+    num = threadEntry->pitchNum;
+    den = threadEntry->pitchDen;
+  } else if (threadInTPI) {
+    num = 254;                 // 25.4mm/tpi
+    den = threadValue * 10;
   } else {
-    imperial = true;
-    threadCount = floor(25.4 / threadCount);
-    current = current / 25.4;
-    leftStop = leftStop / 25.4;
-    rightStop = rightStop / 25.4;
-    jogFeedSpeed = jogFeedSpeed / 25.4;
+    num = threadValue;         // pitch in 1/100 mm
+    den = 100;
+  }
+
+  // steps per pulse = pitch * stepsPerMM / pulsesPerRev
+  num *= stepsPerMM;
+  den *= pulsesPerRev;
+  int64_t divisor = gcd(num, den);
+  ratioNum = num / divisor;
+  ratioDen = den / divisor * numStarts;
+  startPulses = (int64_t)pulsesPerRev * (start - 1);
+}
 
+// step through the standard sizes for the current units. from a custom pitch (or a size from the
+// other table) go to the nearest size first, so the knob doesn't throw away what was set
+void selectThreadSize(int dir) {
+  const ThreadSize *sizes = imperial ? tpiSizes : metricSizes;
+  int count = imperial ? numTPISizes : numMetricSizes;
+  int index;
+
+  if (threadEntry >= sizes && threadEntry < sizes + count) {
+    index = constrain((int)(threadEntry - sizes) + dir, 0, count - 1);
+  } else {
+    // pitches in 1/100000 mm. ties go to the first size in the direction of travel
+    int64_t pitch;
+    if (threadEntry != NULL) {
+      pitch = threadEntry->pitchNum * 100000 / threadEntry->pitchDen;
+    } else if (threadInTPI) {
+      pitch = 2540000 / threadValue;
+    } else {
+      pitch = threadValue * 1000LL;
+    }
+
+    index = dir > 0 ? 0 : count - 1;
+    int64_t best = INT64_MAX;
+    for (int i = index; i >= 0 && i < count; i += (dir > 0 ? 1 : -1)) {
+      int64_t error = sizes[i].pitchNum * 100000 / sizes[i].pitchDen - pitch;
+      if (error < 0) { error = -error; }
+      if (error < best) {
+        best = error;
+        index = i;
+      }
+    }
+
+    // already on that pitch, so the knob has to move it on
+    if (best == 0) { index = constrain(index + dir, 0, count - 1); }
   }
+
+  threadEntry = &sizes[index];
+  threadInTPI = threadEntry->tpi;
+  threadValue = threadEntry->value;
+  updateThreadRatio();
 }
 
+// parse a decimal position in the current units straight to steps without going through float
+long stringToSteps(const char *in) {
+  int64_t value = parseFixed(in, 4); // 0.0001 is plenty of resolution
+  bool negative = value < 0;
 
-float stepsToUnits(long in) {
-  return in / (imperial ? stepsPerMM * 25.4 : stepsPerMM);
+  // value is in 1/10000 units. inch = 254/10 mm
+  int64_t num = (negative ? -value : value) * stepsPerMM * (imperial ? 254 : 10);
+  int64_t den = 100000;
+  long steps = (num + den / 2) / den;
+  return negative ? -steps : steps;
 }
 
-long spindleToStep(float in) {
-  float val;
-  if (imperial) {
-    val = in * stepsPerMM * (1 / threadCount) * 25.4;
+// move the carriage to target. the motor target carries the extra backlash steps on a reversal
+// so the take up is part of the same acceleration profile instead of a separate move.
+// preload (1 = right, -1 = left) takes the slack up while holding, ahead of a move that way
+void planMove(long target, int preload) {
+  long motorTarget;
+  if (target > current) {
+    motorTarget = target;
+  } else if (target < current) {
+    motorTarget = target - backlash;
+  } else if (preload != 0) {
+    motorTarget = preload > 0 ? target : target - backlash;
+  } else {
+    // anywhere in the window holds the carriage still
+    motorTarget = constrain(lsDriver.targetPosition() + stepOffset, target - (long)backlash, target);
+  }
+  if (motorTarget != lsDriver.targetPosition() + stepOffset) {
+    lsDriver.moveTo(motorTarget - stepOffset);
+  }
+  planTarget = target;
+}
+
+// redefine the carriage position without losing where the motor is inside the backlash window
+void setPosition(long position) {
+  stepOffset += position - current;
+  scaleOffset += position - current;
+  xBase += taperOffset(current) - taperOffset(position); // keep the cross slide where it is
+  current = position;
+}
+
+long measuredPosition() {
+  return ((int64_t)scale.read() * stepsPerMM) / scaleCountsPerMM + scaleOffset;
+}
+
+// closed loop - move the step count one step per pass towards what the scale measures so the
+// planner makes up missed steps without a jump. big errors are left for the supervisor
+void correctPosition() {
+  long deadband = stepsPerMM / abs(scaleCountsPerMM) + 1; // one scale count
+  long correction = 0;
+
+  positionError = measuredPosition() - current;
+
+  if (abs(positionError) > deadband) {
+    if (!lsDriver.isRunning() && !threading) {
+      // nothing commanded so the carriage was moved some other way, take the scale's word for it
+      correction = positionError;
+    } else if (abs(positionError) < maxStallError) {
+      correction = positionError > 0 ? 1 : -1;
+    }
+  }
+
+  stepOffset += correction;
+  current += correction;
+}
+
+// X steps for a Z position from zero along the taper
+long taperOffset(long z) {
+  return ((int64_t)z * taper * xStepsPerMM) / ((int64_t)stepsPerMM * 1000);
+}
+
+long crossSlideTarget() {
+  return xBase + taperOffset(current) + (xRetracted ? xRetract : 0);
+}
+
+// jog feed rate in steps/s for the stepper driver
+float feedStepRate() {
+  return ((int64_t)jogFeedRate * stepsPerMM) / 60000.0f;
+}
+
+// carriage travel in the direction of the pass for the spindle pulses since the pass started
+long passTravel(int32_t progress) {
+  if (camEnabled) {
+    return cam.position(camAngle(progress, startPulses, numStarts)); // same start shift as the plain thread below
+  }
+  return -spindleToStep(-progress);
+}
+
+void enableCam(bool on) {
+  camEnabled = on && cam.count() >= 2;
+  camStepsPerRev = 0;
+  for (int i = 1; camEnabled && i < cam.count(); i++) {
+    const CamPoint &a = cam.point(i - 1);
+    const CamPoint &b = cam.point(i);
+    long slope = ((int64_t)abs(b.position - a.position) * pulsesPerRev) / (b.angle - a.angle);
+    if (slope > camStepsPerRev) { camStepsPerRev = slope; }
+  }
+}
+
+// CAM CLEAR | CAM PT revs pos | CAM ON | CAM OFF | CAM LIST | CAM EVAL revs
+// points are converted to pulses and steps on upload, like every other position
+String handleCam(const char *arg, char *&line, bool busy) {
+  if (strcmp(arg, "LIST") == 0) {
+    for (int i = 0; i < cam.count(); i++) {
+      Serial.println("cam " + String(i) + " " + String(cam.point(i).angle) + " " + String(cam.point(i).position));
+    }
+    Serial.println(camEnabled ? "cam on" : "cam off");
+  } else if (strcmp(arg, "EVAL") == 0) {
+    const char *revs = nextToken(line);
+    if (!isNumber(revs, true)) { return "CAM EVAL revs"; }
+    if (cam.count() == 0) { return "no profile"; }
+    int32_t angle = (parseFixed(revs, 4) * pulsesPerRev) / 10000;
+    Serial.println("cam " + String(angle) + " " + String(cam.position(angle)));
+  } else if (busy) {
+    return "busy";
+  } else if (strcmp(arg, "CLEAR") == 0) {
+    cam.clear();
+    enableCam(false);
+  } else if (strcmp(arg, "PT") == 0) {
+    const char *revs = nextToken(line);
+    const char *pos = nextToken(line);
+    if (!isNumber(revs, true) || !isNumber(pos, true)) { return "CAM PT revs pos"; }
+    if (camEnabled) { return "turn the cam off first"; }
+    if (!cam.add((parseFixed(revs, 4) * pulsesPerRev) / 10000, stringToSteps(pos))) {
+      return "angles must increase and fit " + String(maxCamPoints) + " points";
+    }
+  } else if (strcmp(arg, "ON") == 0) {
+    enableCam(true);
+    if (!camEnabled) { return "need at least 2 points"; }
+  } else if (strcmp(arg, "OFF") == 0) {
+    enableCam(false);
+  } else {
+    return "bad cam command";
+  }
+  return "";
+}
+
+// watch for anything that means the thread being cut no longer matches the spindle
+void superviseMotion() {
+  static uint32_t lastPass;
+  static uint32_t followStart;
+  static int32_t lastSpindle;
+  static bool wasThreading;
+  uint32_t now = micros();
+  int32_t spindleDelta = currentSpindle - lastSpindle;
+
+  lastSpindle = currentSpindle;
+
+  if (faultCode != faultNone) {
+    // latched until the operator clears the error page, the carriage is still slowing down
+    followStart = now;
+  } else if (scaleCountsPerMM != 0 && (lsDriver.isRunning() || threading) && abs(positionError) >= maxStallError) {
+    fault(faultStall);
+  } else if (threading) {
+    // the pass before threading started may have been an idle one with a nextion task in it,
+    // so the gap and spindle jump only mean something between two threading passes
+    if (wasThreading && now - lastPass > maxMotionGap) {
+      fault(faultOverrun);
+    } else if (wasThreading && abs(spindleDelta) > pulsesPerRev / 4) {
+      fault(faultEncoder);
+    } else if (stepRateRequired > maxStepRate) {
+      fault(faultStepRate);
+    } else if (abs(planTarget - current) > maxFollowError) {
+      if (now - followStart > followTimeout) { fault(faultFollowing); }
+    } else {
+      followStart = now;
+    }
   } else {
-    val = in * stepsPerMM * threadCount;
+    followStart = now;
+  }
+
+  lastPass = now;
+  wasThreading = threading;
+}
+
+// controlled stop, log the cause and tell the operator
+void fault(int code) {
+  faultCode = code;
+  abortJob();
+  threading = false;
+  threadPending = false;
+  lsDriver.stop();
+
+  Serial.print("fault: ");
+  Serial.println(faultString(code));
+
+  showError(": Motion", faultString(code));
+}
+
+String faultString(int code) {
+  switch (code) {
+    case faultFollowing:
+      return "Carriage lost sync with spindle";
+    case faultStepRate:
+      return "Spindle too fast for max steprate";
+    case faultOverrun:
+      return "Motion loop overrun";
+    case faultEncoder:
+      return "Spindle encoder jump";
+    case faultStall:
+      return "Carriage stalled";
+    case faultPower:
+      return "Power loss, position saved";
+  }
+  return "None";
+}
+
+void popJob() {
+  jobQueue.pop();
+  jobPhase = 0;
+}
+
+void abortJob() {
+  if (jobRunning) {
+    threading = false;
+    lsDriver.stop();
+  }
+  jobRunning = false;
+  jobQueue.clear();
+  jobPhase = 0;
+  threadRequest = threadNone;
+  threadPending = false;
+}
+
+// run the queued commands back to back. called from updateMovement in place of the page handlers
+void processJob() {
+  static uint32_t dwellStart;
+  static long moveTarget;
+  bool done = false;
+
+  // the machine's own controls always win over a job, and nothing runs unsupervised
+  if (!btnLeft.read() || !btnRight.read() || switchEnable.read() != jobSwitch || faultCode != faultNone) {
+    abortJob();
+    Serial.println("job aborted");
+    return;
+  }
+
+  if (jobQueue.count() == 0) {
+    jobRunning = false;
+    Serial.println("job done");
+    return;
+  }
+
+  JobCommand &cmd = jobQueue.at(0);
+
+  switch (cmd.type) {
+    case jobMove:
+      if (jobPhase == 0) {
+        moveTarget = mergeMoves(jobQueue, current);
+        jobPhase = 1;
+      }
+      lsDriver.setMaxSpeed(feedStepRate());
+      planMove(moveTarget);
+      done = current == moveTarget && !lsDriver.isRunning();
+      break;
+    case jobThread:
+      if (!leftStopOn || !rightStopOn) {
+        Serial.println("error: threading needs both stops");
+        abortJob();
+        return;
+      }
+      if (jobPhase == 0) {
+        // feed back to the stop the pass starts from
+        long startSteps = cmd.arg ? leftSteps : rightSteps;
+        lsDriver.setMaxSpeed(feedStepRate());
+        planMove(startSteps);
+        if (current == startSteps && !lsDriver.isRunning()) {
+          threadRequest = cmd.arg;
+          jobPhase = 1;
+        }
+      } else if (jobPhase == 1) {
+        if (threading) { jobPhase = 2; }
+      } else {
+        done = !threading && !lsDriver.isRunning();
+      }
+      processThread();
+      break;
+    case jobDwell:
+      if (jobPhase == 0) {
+        dwellStart = millis();
+        jobPhase = 1;
+      }
+      done = millis() - dwellStart >= (uint32_t)cmd.arg;
+      break;
+    case jobCross:
+      if (jobPhase == 0) {
+        xBase += cmd.arg;
+        jobPhase = 1;
+      }
+      done = xDriver.currentPosition() == crossSlideTarget();
+      break;
+    default:
+      done = true;
+      break;
   }
-  return val;
+
+  if (done) { popJob(); }
 }
 
-long unitsToStep(float in) {
-  return in * (imperial ? stepsPerMM * 25.4 : stepsPerMM);
+// one line per pass at most so a burst of commands can't hold up the motion task
+void readSerial() {
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\n' || c == '\r') {
+      if (serialLength > 0) {
+        serialLine[serialLength] = '\0';
+        serialLength = 0;
+        handleCommand(serialLine);
+        return;
+      }
+    } else if (serialLength < serialLineLength) {
+      serialLine[serialLength++] = toupper(c); // commands are case insensitive
+    }
+  }
+}
+
+// line based protocol, positions and feeds are in the current units
+//   STATUS | STATS | UNITS MM/IN | ZERO (only ABORT, Q and CLEAR while moving)
+//   PITCH mm | TPI n | STARTS n [start] | LSTOP pos/OFF | RSTOP pos/OFF | FEED rate
+//   Q THREAD passes L/R | Q MOVE pos | Q DWELL ms | Q X steps
+//   RUN | ABORT | CLEAR
+//   BACKLASH steps | XSPMM steps | XRETRACT steps | TAPER um/mm | SCALE counts/mm (saved to eeprom)
+//   CAM ... (see handleCam)
+void handleCommand(char *line) {
+  const char *cmd = nextToken(line);
+  const char *arg = nextToken(line);
+  String error;
+  bool busy = threading || jobRunning || lsDriver.isRunning();
+
+  // the serial task runs between motion passes while the carriage moves. only the commands with
+  // a short reply are taken then, STATUS, STATS or CAM LIST could hold up the motion task
+  if (busy && strcmp(cmd, "ABORT") != 0 && strcmp(cmd, "Q") != 0 && strcmp(cmd, "CLEAR") != 0) {
+    error = "busy";
+  } else if (strcmp(cmd, "STATUS") == 0) {
+    printStatus();
+    return;
+  } else if (strcmp(cmd, "STATS") == 0) {
+    printStats();
+    return;
+  } else if (strcmp(cmd, "Q") == 0) {
+    const char *val = nextToken(line);
+    bool ok = true;
+    if (strcmp(arg, "THREAD") == 0) {
+      const char *dir = nextToken(line);
+      if (!isNumber(val, false) || atol(val) < 1 || (strcmp(dir, "L") != 0 && strcmp(dir, "R") != 0)) {
+        error = "Q THREAD passes L/R";
+      }
+      for (long i = 0; ok && error.length() == 0 && i < atol(val); i++) {
+        ok = jobQueue.push(jobThread, strcmp(dir, "R") == 0 ? 1 : 0);
+      }
+    } else if (strcmp(arg, "MOVE") == 0) {
+      if (isNumber(val, true)) { ok = jobQueue.push(jobMove, stringToSteps(val)); } else { error = "Q MOVE pos"; }
+    } else if (strcmp(arg, "DWELL") == 0) {
+      if (isNumber(val, false) && atol(val) >= 0) { ok = jobQueue.push(jobDwell, atol(val)); } else { error = "Q DWELL ms"; }
+    } else if (strcmp(arg, "X") == 0) {
+      if (isNumber(val, false)) { ok = jobQueue.push(jobCross, atol(val)); } else { error = "Q X steps"; }
+    } else {
+      error = "bad job command";
+    }
+    if (!ok) { error = "queue full"; }
+  } else if (strcmp(cmd, "RUN") == 0) {
+    if (busy) {
+      error = "busy";
+    } else if (faultCode != faultNone) {
+      error = "clear the fault on the display first"; // the supervisor is latched off until then
+    } else {
+      jobPhase = 0;
+      jobSwitch = switchEnable.read();
+      jobRunning = jobQueue.count() > 0;
+    }
+  } else if (strcmp(cmd, "CAM") == 0) {
+    error = handleCam(arg, line, busy);
+  } else if (strcmp(cmd, "ABORT") == 0) {
+    abortJob();
+  } else if (strcmp(cmd, "CLEAR") == 0) {
+    if (jobRunning) { error = "busy"; } else { jobQueue.clear(); }
+  } else if (busy) {
+    error = "busy";
+  } else if (strcmp(cmd, "UNITS") == 0) {
+    if (strcmp(arg, "IN") == 0) {
+      imperial = true;
+    } else if (strcmp(arg, "MM") == 0) {
+      imperial = false;
+    } else {
+      error = "units are MM or IN";
+    }
+  } else if (strcmp(cmd, "ZERO") == 0) {
+    setPosition(0);
+  } else if ((strcmp(cmd, "PITCH") == 0 || strcmp(cmd, "FEED") == 0) && !isNumber(arg, true)) {
+    error = String(cmd) + " needs a number";
+  } else if ((strcmp(cmd, "TPI") == 0 || strcmp(cmd, "STARTS") == 0) && !isNumber(arg, false)) {
+    error = String(cmd) + " needs a whole number";
+  } else if (strcmp(cmd, "PITCH") == 0) {
+    threadValue = constrain((int)parseFixed(arg, 2), minPitch, maxPitch);
+    threadInTPI = false;
+    threadEntry = NULL;
+    updateThreadRatio();
+  } else if (strcmp(cmd, "TPI") == 0) {
+    threadValue = constrain((int)atol(arg), minTPI, maxTPI);
+    threadInTPI = true;
+    threadEntry = NULL;
+    updateThreadRatio();
+  } else if (strcmp(cmd, "STARTS") == 0) {
+    const char *startArg = nextToken(line);
+    if (*startArg != '\0' && !isNumber(startArg, false)) {
+      error = "STARTS n [start]";
+    } else {
+      numStarts = constrain((int)atol(arg), 1, 5);
+      start = constrain((int)atol(startArg), 1, numStarts);
+      updateThreadRatio();
+    }
+  } else if ((strcmp(cmd, "LSTOP") == 0 || strcmp(cmd, "RSTOP") == 0) && strcmp(arg, "OFF") != 0 && !isNumber(arg, true)) {
+    error = String(cmd) + " pos/OFF";
+  } else if (strcmp(cmd, "LSTOP") == 0) {
+    leftStopOn = strcmp(arg, "OFF") != 0;
+    leftSteps = leftStopOn ? stringToSteps(arg) : 0;
+  } else if (strcmp(cmd, "RSTOP") == 0) {
+    rightStopOn = strcmp(arg, "OFF") != 0;
+    rightSteps = rightStopOn ? stringToSteps(arg) : 0;
+  } else if (strcmp(cmd, "FEED") == 0) {
+    // hundredths of mm/s or ipm to um/min
+    jogFeedRate = constrain((long)parseFixed(arg, 2) * (imperial ? 254 : 600), 1L, (long)maxFeed);
+  } else if (strcmp(cmd, "BACKLASH") == 0 || strcmp(cmd, "XSPMM") == 0 || strcmp(cmd, "XRETRACT") == 0 ||
+             strcmp(cmd, "TAPER") == 0 || strcmp(cmd, "SCALE") == 0) {
+    error = handleSetup(cmd, arg);
+  } else {
+    error = "unknown command";
+  }
+
+  if (error.length() == 0) { pageDirty = true; }
+
+  // don't wait on a host that has stopped reading while the carriage is moving
+  if (busy && Serial.availableForWrite() < serialLineLength) { return; }
+
+  if (error.length() > 0) {
+    Serial.println("error: " + error);
+  } else {
+    Serial.println("ok");
+  }
+}
+
+// the setup values the nextion setup page sets, same limits
+String handleSetup(const char *cmd, const char *arg) {
+  if (!isNumber(arg, false)) { return String(cmd) + " needs a number"; }
+  int value = atol(arg);
+
+  if (strcmp(cmd, "BACKLASH") == 0) {
+    backlash = constrain(value, 0, maxBacklash);
+  } else if (strcmp(cmd, "XSPMM") == 0) {
+    xStepsPerMM = value;
+    if (xStepsPerMM < 1) { xStepsPerMM = 1; }
+  } else if (strcmp(cmd, "XRETRACT") == 0) {
+    xRetract = value;
+  } else if (strcmp(cmd, "TAPER") == 0) {
+    taper = constrain(value, -maxTaper, maxTaper);
+  } else {
+    scaleCountsPerMM = value;
+    scaleOffset = current - (scaleCountsPerMM != 0 ? ((int64_t)scale.read() * stepsPerMM) / scaleCountsPerMM : 0);
+  }
+  eepromPut();
+  return "";
+}
+
+void printStatus() {
+  Serial.println("position " + positionString() + unitString(false));
+  if (scaleCountsPerMM != 0) { Serial.println("scale error " + String(positionError) + " steps"); }
+  Serial.println("left " + (leftStopOn ? stepsToString(leftSteps) : String("off")));
+  Serial.println("right " + (rightStopOn ? stepsToString(rightSteps) : String("off")));
+  Serial.println("thread " + threadString() + " start " + String(start) + " of " + String(numStarts));
+  Serial.println("cam " + String(cam.count()) + " points" + (camEnabled ? " on" : " off"));
+  Serial.println("feed " + feedString());
+  Serial.println("rpm " + rpmString());
+  Serial.println("job " + String(jobQueue.count()) + (jobRunning ? " running" : " stopped"));
+  Serial.println("fault " + faultString(faultCode));
+}
+
+void printStats() {
+  for (unsigned int i = 0; i < numTasks; i++) {
+    Task &task = tasks[i];
+    Serial.print(task.name);
+    Serial.print(" runs " + String(task.runs));
+    Serial.print(" avg " + String(task.runs ? task.totalTime / task.runs : 0));
+    Serial.print(" max " + String(task.maxTime));
+    Serial.println(" overruns " + String(task.overruns));
+  }
 }
 
 bool closeEnough(float v1, float v2, float tolerance) {
@@ -465,6 +1378,24 @@ void eepromGet() {
   EEPROM.get(8, stepsPerMM);
   EEPROM.get(12, acceleration);
   EEPROM.get(16, maxStepRate);
+
+  int layout;
+  EEPROM.get(40, layout);
+  if (layout != eepromLayout) {
+    // saved by firmware from before the values below, keep the defaults and write them out
+    eepromPut();
+    return;
+  }
+
+  EEPROM.get(20, backlash);
+  EEPROM.get(24, xStepsPerMM);
+  EEPROM.get(28, xRetract);
+  EEPROM.get(32, taper);
+  EEPROM.get(36, scaleCountsPerMM);
+
+  if (backlash < 0 || backlash > maxBacklash) { backlash = 0; }
+  if (xStepsPerMM < 1) { xStepsPerMM = 800; }
+  if (taper < -maxTaper || taper > maxTaper) { taper = 0; }
 }
 
 void eepromPut() {
@@ -473,14 +1404,123 @@ void eepromPut() {
   EEPROM.put(8, stepsPerMM);
   EEPROM.put(12, acceleration);
   EEPROM.put(16, maxStepRate);
+  EEPROM.put(20, backlash);
+  EEPROM.put(24, xStepsPerMM);
+  EEPROM.put(28, xRetract);
+  EEPROM.put(32, taper);
+  EEPROM.put(36, scaleCountsPerMM);
+  EEPROM.put(40, eepromLayout);
 }
 
-// update the Nextion based on which page is currently being displayed
-void updateNextion() {
-  static elapsedMillis tmrNextionUpdate;
+void powerFail() {
+  powerLost = true;
+}
 
-  nex.NextionListen();
+// the isr only sets the flag so the snapshot is never taken half way through a motion pass
+void checkPower() {
+  static elapsedMillis powerGood;
+
+  // a brown-out that didn't reset us. the saved state goes stale from here on, so a later
+  // reset mustn't bring it back
+  if (digitalRead(powerSense) == LOW) { powerGood = 0; }
+  if (snapshotSaved && !powerLost && powerGood >= powerRecoverTime) {
+    snapshotClear();
+    Serial.println("power back, saved motion state dropped");
+  }
+
+  if (!powerLost) { return; }
+  powerLost = false;
 
+  // freeze both axes where they are so the saved position is the real one
+  lsDriver.setCurrentPosition(lsDriver.currentPosition());
+  xDriver.setCurrentPosition(xDriver.currentPosition());
+  snapshotPut();
+  powerGood = 0; // the line may already be back up by the time this runs
+  fault(faultPower);
+}
+
+void snapshotPut() {
+  Snapshot snap;
+  memset(&snap, 0, sizeof(snap)); // padding goes into the crc as well
+
+  snap.magic = snapshotMagic;
+  snap.position = current;
+  snap.slack = lsDriver.currentPosition() + stepOffset - current;
+  snap.leftSteps = leftSteps;
+  snap.rightSteps = rightSteps;
+  snap.spindle = spindle.read();
+  snap.xPosition = xDriver.currentPosition();
+  snap.xBase = xBase;
+  snap.jogFeedRate = jogFeedRate;
+  snap.threadValue = threadValue;
+  snap.threadSize = threadEntry == NULL ? -1 : threadEntry - (threadInTPI ? tpiSizes : metricSizes);
+  snap.numStarts = numStarts;
+  snap.start = start;
+  snap.leftStopOn = leftStopOn;
+  snap.rightStopOn = rightStopOn;
+  snap.imperial = imperial;
+  snap.threadInTPI = threadInTPI;
+  snap.xRetracted = xRetracted;
+  snap.crc = crc32((const uint8_t *)&snap, offsetof(Snapshot, crc));
+
+  EEPROM.put(snapshotAddress, snap);
+  snapshotSaved = true;
+}
+
+// restore and then invalidate, so a later reset without a power loss doesn't bring back stale state.
+// the spindle is assumed not to have turned while the power was off
+bool snapshotGet() {
+  Snapshot snap;
+  EEPROM.get(snapshotAddress, snap);
+
+  if (snap.magic != snapshotMagic || snap.crc != crc32((const uint8_t *)&snap, offsetof(Snapshot, crc))) {
+    return false;
+  }
+
+  current = snap.position;
+  stepOffset = snap.position + constrain(snap.slack, -(long)backlash, 0L) - lsDriver.currentPosition();
+  scaleOffset = snap.position - (scaleCountsPerMM != 0 ? ((int64_t)scale.read() * stepsPerMM) / scaleCountsPerMM : 0);
+  leftSteps = snap.leftSteps;
+  rightSteps = snap.rightSteps;
+  spindle.write(snap.spindle);
+  xDriver.setCurrentPosition(snap.xPosition);
+  xBase = snap.xBase;
+  jogFeedRate = snap.jogFeedRate;
+  threadValue = snap.threadValue;
+  threadInTPI = snap.threadInTPI;
+  if (snap.threadSize >= 0 && snap.threadSize < (threadInTPI ? numTPISizes : numMetricSizes)) {
+    threadEntry = (threadInTPI ? tpiSizes : metricSizes) + snap.threadSize;
+  }
+  numStarts = snap.numStarts;
+  start = snap.start;
+  leftStopOn = snap.leftStopOn;
+  rightStopOn = snap.rightStopOn;
+  imperial = snap.imperial;
+  xRetracted = snap.xRetracted;
+
+  snapshotClear();
+  return true;
+}
+
+void snapshotClear() {
+  EEPROM.put(snapshotAddress, (uint32_t)0); // just the magic
+  snapshotSaved = false;
+}
+
+uint32_t crc32(const uint8_t *data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+// update the Nextion based on which page is currently being displayed
+// the refresh rate is set by the nexupdate task
+void updateNextion() {
   switch (currentPage)
   {
   case pageDebug:
@@ -488,26 +1528,18 @@ void updateNextion() {
   case pageScope:
     break;
   case pageJogFeed:
-    if (tmrNextionUpdate > 50) {
-      tmrNextionUpdate = 0;
-      nex.writeStr("powerfeed.fr.txt", feedString());
-      nex.writeStr("powerfeed.position.txt", positionString());
-      nex.writeStr("powerfeed.rpm.txt", rpmString());
-    }
+    nex.writeStr("powerfeed.fr.txt", feedString());
+    nex.writeStr("powerfeed.position.txt", positionString());
+    nex.writeStr("powerfeed.rpm.txt", rpmString());
+    break;
   case pageMenu:
-    if (tmrNextionUpdate > 50) {
-      tmrNextionUpdate = 0;
-      nex.writeStr("menu.fr.txt", feedString());
-      nex.writeStr("menu.rpm.txt", rpmString());
-    }
+    nex.writeStr("menu.fr.txt", feedString());
+    nex.writeStr("menu.rpm.txt", rpmString());
     break;
   case pageThreading:
-    if (tmrNextionUpdate > 50) {
-      tmrNextionUpdate = 0;
-      nex.writeStr("threading.position.txt", positionString());
-      nex.writeStr("threading.pitch.txt", threadString());
-      nex.writeStr("threading.rpm.txt", rpmString());
-    }
+    nex.writeStr("threading.position.txt", positionString());
+    nex.writeStr("threading.pitch.txt", threadString());
+    nex.writeStr("threading.rpm.txt", rpmString());
     break;
   default:
     break;
@@ -517,7 +1549,7 @@ void updateNextion() {
 void showError(String title, String message) {
   nex.writeStr("error.title.txt", "Error" + title);
   nex.writeStr("error.message.txt", message);
-  returnPage = currentPage;
+  if (currentPage != pageError) { returnPage = currentPage; } // don't lose the page under a second error
   gotoPage(pageError);
 }
 
@@ -544,6 +1576,7 @@ void inputNumber(String question, int var, int initialValue) {
 // do full page update and request page change to that updated page
 void gotoPage(int page)
 {
+  threadPending = false; // a pass waiting on the cross slide belongs to the page it was started from
   updatePage(page);
   currentPage = page;
   String i = "page ";
@@ -561,14 +1594,14 @@ void updatePage(int page)
     case (pageJogFeed):
       nex.writeStr("powerfeed.fr.txt", feedString());
       nex.writeStr("powerfeed.position.txt", positionString());      
-      nex.writeStr("powerfeed.leftstop.txt", (leftStopOn ? unitsToString(leftStop) : "---"));
-      nex.writeStr("powerfeed.rightstop.txt", (rightStopOn ? unitsToString(rightStop) : "---"));
+      nex.writeStr("powerfeed.leftstop.txt", (leftStopOn ? stepsToString(leftSteps) : "---"));
+      nex.writeStr("powerfeed.rightstop.txt", (rightStopOn ? stepsToString(rightSteps) : "---"));
       nex.writeStr("powerfeed.units.txt", unitString(true));      
       break;
     case (pageThreading):
       nex.writeStr("threading.position.txt", positionString());      
-      nex.writeStr("threading.leftstop.txt", (leftStopOn ? unitsToString(leftStop) : "---"));
-      nex.writeStr("threading.rightstop.txt", (rightStopOn ? unitsToString(rightStop) : "---"));
+      nex.writeStr("threading.leftstop.txt", (leftStopOn ? stepsToString(leftSteps) : "---"));
+      nex.writeStr("threading.rightstop.txt", (rightStopOn ? stepsToString(rightSteps) : "---"));
       nex.writeStr("threading.starts.txt", String(start) + " of " + String(numStarts));
       nex.writeStr("threading.bunits.txt", unitString(true));
       nex.writeStr("threading.threadlabel.txt", "Thread:"); //" + imperial ? "(tpi):" : "(mm):"); //remove this crap
@@ -591,6 +1624,11 @@ void updatePage(int page)
       nex.writeStr("setup.spmm.txt", String(stepsPerMM));
       nex.writeStr("setup.accel.txt", String(acceleration / 1000));
       nex.writeStr("setup.steprate.txt", String(maxStepRate / 1000));
+      nex.writeStr("setup.backlash.txt", String(backlash));
+      nex.writeStr("setup.xspmm.txt", String(xStepsPerMM));
+      nex.writeStr("setup.xretract.txt", String(xRetract));
+      nex.writeStr("setup.taper.txt", String(taper));
+      nex.writeStr("setup.scale.txt", String(scaleCountsPerMM));
       break;
   }
 }
@@ -608,36 +1646,38 @@ void trigger0() { // handle UI triggers on input page
         case varLeftStop:
           if (inputPositionValue.length() > 0) {
             leftStopOn = true;
-            leftStop = inputPositionValue.toFloat();
-            leftSteps = unitsToStep(leftStop);
+            leftSteps = stringToSteps(inputPositionValue.c_str());
           } else {
             leftStopOn = false;
-            leftStop = 0;
             leftSteps = 0;
           }
-          nex.writeStr("powerfeed.leftstop.txt", (leftStopOn ? unitsToString(leftStop) : ""));
+          nex.writeStr("powerfeed.leftstop.txt", (leftStopOn ? stepsToString(leftSteps) : ""));
           break;
         case varRightStop:
           if (inputPositionValue.length() > 0) {
             rightStopOn = true;
-            rightStop = inputPositionValue.toFloat();
-            rightSteps = unitsToStep(rightStop);
+            rightSteps = stringToSteps(inputPositionValue.c_str());
           } else {
             rightStopOn = false;
-            rightStop = 0;
             rightSteps = 0;
           }
-          nex.writeStr("powerfeed.rightstop.txt", (rightStopOn ? unitsToString(rightStop) : ""));
+          nex.writeStr("powerfeed.rightstop.txt", (rightStopOn ? stepsToString(rightSteps) : ""));
           break;
         case varPPR:
           pulsesPerRev = inputPositionValue.toInt() * 4;
           if (pulsesPerRev < 1) { pulsesPerRev = 1; }
+          updateThreadRatio();
+          cam.clear(); // the profile was converted with the old setup
+          enableCam(false);
           nex.writeStr("setup.ppr.txt", String(pulsesPerRev / 4));
           eepromPut();
           break;
         case varSPMM:
           stepsPerMM = inputPositionValue.toInt();
           if (stepsPerMM < 1) { stepsPerMM = 1; }
+          updateThreadRatio();
+          cam.clear();
+          enableCam(false);
           nex.writeStr("setup.spmm.txt", String(stepsPerMM));
           eepromPut();
           break;
@@ -645,6 +1685,7 @@ void trigger0() { // handle UI triggers on input page
           acceleration = inputPositionValue.toInt() * 1000;
           nex.writeStr("setup.accel.txt", String(acceleration / 1000));
           lsDriver.setAcceleration(acceleration);
+          xDriver.setAcceleration(acceleration);
           eepromPut();
           break;
         case varSteprate:
@@ -652,6 +1693,33 @@ void trigger0() { // handle UI triggers on input page
           nex.writeStr("setup.steprate.txt", String(maxStepRate / 1000));
           eepromPut();
           break;
+        case varBacklash:
+          backlash = constrain((int)inputPositionValue.toInt(), 0, maxBacklash);
+          nex.writeStr("setup.backlash.txt", String(backlash));
+          eepromPut();
+          break;
+        case varXSPMM:
+          xStepsPerMM = inputPositionValue.toInt();
+          if (xStepsPerMM < 1) { xStepsPerMM = 1; }
+          nex.writeStr("setup.xspmm.txt", String(xStepsPerMM));
+          eepromPut();
+          break;
+        case varXRetract:
+          xRetract = inputPositionValue.toInt();
+          nex.writeStr("setup.xretract.txt", String(xRetract));
+          eepromPut();
+          break;
+        case varTaper:
+          taper = constrain((int)inputPositionValue.toInt(), -maxTaper, maxTaper);
+          nex.writeStr("setup.taper.txt", String(taper));
+          eepromPut();
+          break;
+        case varScale:
+          scaleCountsPerMM = inputPositionValue.toInt();
+          scaleOffset = current - (scaleCountsPerMM != 0 ? ((int64_t)scale.read() * stepsPerMM) / scaleCountsPerMM : 0);
+          nex.writeStr("setup.scale.txt", String(scaleCountsPerMM));
+          eepromPut();
+          break;
       }
       gotoPage(returnPage);
       break;
@@ -676,7 +1744,7 @@ void trigger0() { // handle UI triggers on input page
       }
       break;
     case keyCurrent:
-      inputPositionValue = floatToString(current);
+      inputPositionValue = stepsToString(current);
       break;
     case keyBS:
       if (inputPositionValue.length() > 1) {
@@ -690,12 +1758,12 @@ void trigger0() { // handle UI triggers on input page
       switch (inputPositionVar) {
         case varLeftStop:
           leftStopOn = false;
-          leftStop = 0;
+          leftSteps = 0;
           nex.writeStr("powerfeed.leftstop.txt", "---");
           break;
         case varRightStop:
           rightStopOn = false;
-          rightStop = 0;
+          rightSteps = 0;
           nex.writeStr("powerfeed.rightstop.txt", "---");
           break;
       }
@@ -730,38 +1798,37 @@ void trigger1() { // handle UI triggers on main menu page
 void trigger6() { // handle UI triggers on feed page
   switch (nex.readNumber("powerfeed.key.val")) {
     case 0:
-      leftStop = current;
+      leftSteps = current;
       leftStopOn = true;
-      nex.writeStr("powerfeed.leftstop.txt", floatToString(leftStop));
+      nex.writeStr("powerfeed.leftstop.txt", stepsToString(leftSteps));
       break;
     case 1:
-      current = 0;
-      lsDriver.setCurrentPosition(0);
+      setPosition(0);
       nex.writeStr("powerfeed.position.txt", positionString());      
       break;
     case 2:
-      rightStop = current;
+      rightSteps = current;
       rightStopOn = true;
-      nex.writeStr("powerfeed.rightstop.txt", floatToString(rightStop));
+      nex.writeStr("powerfeed.rightstop.txt", stepsToString(rightSteps));
       break;
     case 3:
       invertUnits();
       updatePage(currentPage);
       break;
     case 4:
-      jogFeedMulti = 0.01;
+      jogFeedMulti = 1;
       break;
     case 5:
-      jogFeedMulti = 0.1;
+      jogFeedMulti = 10;
       break;
     case 6:
-      jogFeedMulti = 1;
+      jogFeedMulti = 100;
       break;
     case 7:
-      inputPosition("Left Stop Position (" + unitString(true) + ")", varLeftStop, floatToString(leftStop));
+      inputPosition("Left Stop Position (" + unitString(true) + ")", varLeftStop, stepsToString(leftSteps));
       break;
     case 8:
-      inputPosition("Right Stop Position (" + unitString(true) + ")", varRightStop, floatToString(rightStop));
+      inputPosition("Right Stop Position (" + unitString(true) + ")", varRightStop, stepsToString(rightSteps));
       break;
     case 9:
       gotoPage(pageMenu);
@@ -781,14 +1848,13 @@ void trigger7() { // handle UI triggers on threading page
       gotoPage(pageMenu);
       break;
     case 3:
-      inputPosition("Left Stop Position (" + unitString(true) + ")", varLeftStop, floatToString(leftStop));
+      inputPosition("Left Stop Position (" + unitString(true) + ")", varLeftStop, stepsToString(leftSteps));
       break;
     case 4:
-      inputPosition("Right Stop Position (" + unitString(true) + ")", varRightStop, floatToString(rightStop));  
+      inputPosition("Right Stop Position (" + unitString(true) + ")", varRightStop, stepsToString(rightSteps));  
       break;
     case 5:
-      current = 0;
-      lsDriver.setCurrentPosition(0);
+      setPosition(0);
       updatePage(pageThreading);
       break;
   }
@@ -798,7 +1864,6 @@ void trigger8() { // handle UI triggers on starts page
   int val = nex.readNumber("starts.key.val");
   switch (val) {
     case 0: //ok
-      startOffset = (1.0 / numStarts) * (start - 1);
       gotoPage(pageThreading);
       break;
     default:
@@ -808,6 +1873,7 @@ void trigger8() { // handle UI triggers on starts page
         numStarts = val - 5;
         if (start > numStarts) { start = numStarts; }
       }
+      updateThreadRatio();
       updatePage(pageStarts);
       break;
   }  
@@ -831,6 +1897,21 @@ void trigger9() { // handle UI triggers on setup page
     case 3:
       inputNumber("Maximum Steprate (x1000)", varSteprate, maxStepRate / 1000);
       break;
+    case 4:
+      inputNumber("Backlash (steps)", varBacklash, backlash);
+      break;
+    case 5:
+      inputNumber("Cross Slide Steps/MM", varXSPMM, xStepsPerMM);
+      break;
+    case 6:
+      inputNumber("Thread Retract (X steps)", varXRetract, xRetract);
+      break;
+    case 7:
+      inputNumber("Taper (X um per Z mm)", varTaper, taper);
+      break;
+    case 8:
+      inputNumber("Scale Counts/MM (0 = none)", varScale, scaleCountsPerMM);
+      break;
   }
 }
 
@@ -838,17 +1919,24 @@ void trigger10() {
   int val = nex.readNumber("error.key.val");
   switch (val) {
     case -1:
+      faultCode = faultNone;
       gotoPage(returnPage);
       break;
   }
 }
 
 String positionString() {
-  return String(current, 3);
+  return String(stepsToUnits(current), 3);
 }
 
 String threadString() {
-  return imperial ? String(threadCount, 0) + " tpi" : String(threadCount, 2) + "mm";
+  if (threadEntry != NULL) {
+    return String(threadEntry->name) + (threadEntry->tpi ? " " + String(threadEntry->value) + " tpi" : " " + String(threadEntry->value / 100.0, 2) + "mm");
+  }
+  if (imperial) {
+    return threadInTPI ? String(threadValue) + " tpi" : String(2540.0 / threadValue, 1) + " tpi";
+  }
+  return threadInTPI ? String(25.4 / threadValue, 3) + "mm" : String(threadValue / 100.0, 2) + "mm";
 }
 
 String rpmString() {
@@ -856,7 +1944,7 @@ String rpmString() {
 }
 
 String feedString() {
-  return String((imperial ? jogFeedSpeed * 60 : jogFeedSpeed), 2) + (imperial ? "ipm" : "mm/s");
+  return String((imperial ? jogFeedRate / 25400.0 : jogFeedRate / 60000.0), 2) + (imperial ? "ipm" : "mm/s");
 }
 
 String unitString(bool spell) {
@@ -886,8 +1974,8 @@ String floatToString(float in) {
   return ret;
 }
 
-String unitsToString(float in) {
-  String ret = floatToString(in);
+String stepsToString(long in) {
+  String ret = floatToString(stepsToUnits(in));
   //ret += unitString(false);
   return ret;
 }
@@ -0,0 +1,148 @@
+// cam profile tests, run on the host with: pio test -e native
+//
+// the interpolation is checked against the exact rational profile the points were taken from
+
+#include <unity.h>
+#include <LSCore.h>
+
+void setUp() {}
+void tearDown() {}
+
+// true if position is less than a step from the exact position on the segment a-b
+bool onSegment(long position, int32_t angle, int32_t a, long pa, int32_t b, long pb) {
+  int64_t exact = (int64_t)pa * (b - a) + (int64_t)(angle - a) * (pb - pa); // times (b - a)
+  int64_t error = (int64_t)position * (b - a) - exact;
+  return error > -(b - a) && error < (b - a);
+}
+
+void test_constant_pitch() {
+  // 1.5mm pitch at 800 steps/mm and 2400 pulses/rev = 1/2 step per pulse
+  CamProfile cam;
+  for (int i = 0; i <= 4; i++) { TEST_ASSERT_TRUE(cam.add(i * 2400, i * 1200L)); }
+
+  for (int32_t angle = 0; angle <= 4 * 2400; angle++) {
+    TEST_ASSERT_EQUAL_INT32(angle / 2, cam.position(angle));
+  }
+}
+
+void test_ramp_profile() {
+  // lead in at half pitch, full pitch, then a short pull back. odd spacings so the divides don't come out even
+  const int32_t angles[] = { 0, 1001, 3400, 7777, 8000 };
+  const long positions[] = { 0, 233, 1433, 3934, 3871 };
+  CamProfile cam;
+  for (int i = 0; i < 5; i++) { TEST_ASSERT_TRUE(cam.add(angles[i], positions[i])); }
+
+  for (int i = 0; i < 4; i++) {
+    for (int32_t angle = angles[i]; angle < angles[i + 1]; angle++) {
+      TEST_ASSERT_TRUE(onSegment(cam.position(angle), angle, angles[i], positions[i], angles[i + 1], positions[i + 1]));
+    }
+  }
+  TEST_ASSERT_EQUAL_INT32(3871, cam.position(8000));
+}
+
+void test_segment_walk_back() {
+  const int32_t angles[] = { 100, 500, 900, 1300, 1700 };
+  const long positions[] = { 10, 50, -30, 200, 210 };
+  CamProfile cam;
+  for (int i = 0; i < 5; i++) { cam.add(angles[i], positions[i]); }
+
+  // forward to the last segment, then back to the first and into the middle, as a pass
+  // started behind the thread or a restart would
+  const int32_t order[] = { 1650, 150, 1299, 1300, 499, 500, 901, 100, 1699, 700 };
+  for (unsigned int i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+    int32_t angle = order[i];
+    int s = 0;
+    while (angle >= angles[s + 1]) { s++; }
+    TEST_ASSERT_TRUE(onSegment(cam.position(angle), angle, angles[s], positions[s], angles[s + 1], positions[s + 1]));
+  }
+}
+
+void test_clamping() {
+  CamProfile cam;
+  cam.add(240, -5);
+  cam.add(2640, 395);
+  cam.add(5040, 1195);
+
+  TEST_ASSERT_EQUAL_INT32(-5, cam.position(240));
+  TEST_ASSERT_EQUAL_INT32(-5, cam.position(0));
+  TEST_ASSERT_EQUAL_INT32(-5, cam.position(-2400)); // behind the start of the pass
+  TEST_ASSERT_EQUAL_INT32(1195, cam.position(5040));
+  TEST_ASSERT_EQUAL_INT32(1195, cam.position(100000));
+
+  // and back inside after clamping at either end
+  TEST_ASSERT_EQUAL_INT32(395, cam.position(2640));
+  TEST_ASSERT_EQUAL_INT32(-5 + 200, cam.position(1440));
+}
+
+void test_later_start() {
+  // start 2 of 3 at 2400 pulses/rev runs the profile 800 pulses later than start 1
+  const int64_t startPulses = 2400;
+  const int numStarts = 3;
+  CamProfile cam;
+  cam.add(0, 0);
+  cam.add(2400, 100);
+  cam.add(4800, 300);
+
+  TEST_ASSERT_EQUAL_INT32(-800, camAngle(0, startPulses, numStarts));
+  TEST_ASSERT_EQUAL_INT32(0, cam.position(camAngle(0, startPulses, numStarts)));
+  TEST_ASSERT_EQUAL_INT32(0, cam.position(camAngle(800, startPulses, numStarts)));
+  TEST_ASSERT_EQUAL_INT32(100, cam.position(camAngle(3200, startPulses, numStarts)));
+
+  // the pass runs the whole profile, tail included, before it ends
+  TEST_ASSERT_FALSE(cam.done(camAngle(4800, startPulses, numStarts)));
+  TEST_ASSERT_FALSE(cam.done(camAngle(5599, startPulses, numStarts)));
+  TEST_ASSERT_TRUE(cam.done(camAngle(5600, startPulses, numStarts)));
+  TEST_ASSERT_EQUAL_INT32(299, cam.position(camAngle(5599, startPulses, numStarts)));
+
+  // the first start isn't shifted
+  TEST_ASSERT_EQUAL_INT32(4800, camAngle(4800, 0, numStarts));
+  TEST_ASSERT_TRUE(cam.done(camAngle(4800, 0, numStarts)));
+}
+
+void test_add_rules() {
+  CamProfile cam;
+
+  TEST_ASSERT_FALSE(cam.add(-1, 0));
+  TEST_ASSERT_TRUE(cam.add(0, 0));
+  TEST_ASSERT_FALSE(cam.add(0, 10)); // angles must increase
+  TEST_ASSERT_TRUE(cam.add(1, 10));
+  TEST_ASSERT_EQUAL_INT(2, cam.count());
+
+  cam.clear();
+  for (int i = 0; i < maxCamPoints; i++) { TEST_ASSERT_TRUE(cam.add(i * 10, i)); }
+  TEST_ASSERT_FALSE(cam.add(maxCamPoints * 10, 0));
+  TEST_ASSERT_EQUAL_INT(maxCamPoints, cam.count());
+
+  // a shorter profile after a long one mustn't use the old segment
+  TEST_ASSERT_EQUAL_INT32(60, cam.position(605));
+  cam.clear();
+  cam.add(0, 0);
+  cam.add(100, 1000);
+  TEST_ASSERT_EQUAL_INT32(500, cam.position(50));
+}
+
+int runTests() {
+  UNITY_BEGIN();
+  RUN_TEST(test_constant_pitch);
+  RUN_TEST(test_ramp_profile);
+  RUN_TEST(test_segment_walk_back);
+  RUN_TEST(test_clamping);
+  RUN_TEST(test_later_start);
+  RUN_TEST(test_add_rules);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+void setup() {
+  delay(2000); // give the usb serial time to come up
+  runTests();
+}
+
+void loop() {}
+#else
+int main() {
+  return runTests();
+}
+#endif
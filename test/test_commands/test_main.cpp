@@ -0,0 +1,159 @@
+// command parsing and job queue tests, run on the host with: pio test -e native
+
+#include <unity.h>
+#include <string.h>
+#include <LSCore.h>
+
+void setUp() {}
+void tearDown() {}
+
+void test_parse_fixed() {
+  TEST_ASSERT_EQUAL_INT64(150, parseFixed("1.5", 2));
+  TEST_ASSERT_EQUAL_INT64(100, parseFixed("1", 2));
+  TEST_ASSERT_EQUAL_INT64(125, parseFixed("1.25", 2));
+  TEST_ASSERT_EQUAL_INT64(125, parseFixed("1.259", 2)); // extra digits are cut, not rounded
+  TEST_ASSERT_EQUAL_INT64(-5, parseFixed("-.05", 2));
+  TEST_ASSERT_EQUAL_INT64(50000, parseFixed("5.", 4));
+  TEST_ASSERT_EQUAL_INT64(12345678, parseFixed("1234.5678", 4));
+  TEST_ASSERT_EQUAL_INT64(0, parseFixed("", 2));
+  TEST_ASSERT_EQUAL_INT64(42, parseFixed("42", 0));
+}
+
+void test_is_number() {
+  TEST_ASSERT_TRUE(isNumber("12", false));
+  TEST_ASSERT_TRUE(isNumber("-3", false));
+  TEST_ASSERT_TRUE(isNumber("1.25", true));
+  TEST_ASSERT_TRUE(isNumber("-.5", true));
+  TEST_ASSERT_TRUE(isNumber("5.", true));
+  TEST_ASSERT_FALSE(isNumber("", true));
+  TEST_ASSERT_FALSE(isNumber("-", true));
+  TEST_ASSERT_FALSE(isNumber(".", true));
+  TEST_ASSERT_FALSE(isNumber("1.5", false));
+  TEST_ASSERT_FALSE(isNumber("1.2.3", true));
+  TEST_ASSERT_FALSE(isNumber("1-2", true));
+  TEST_ASSERT_FALSE(isNumber("OFF", true));
+  TEST_ASSERT_FALSE(isNumber("12MM", true));
+}
+
+void test_next_token() {
+  char buffer[] = "  Q  MOVE 12.5\tR";
+  char *line = buffer;
+
+  TEST_ASSERT_EQUAL_STRING("Q", nextToken(line));
+  TEST_ASSERT_EQUAL_STRING("MOVE", nextToken(line));
+  TEST_ASSERT_EQUAL_STRING("12.5", nextToken(line));
+  TEST_ASSERT_EQUAL_STRING("R", nextToken(line));
+  TEST_ASSERT_EQUAL_STRING("", nextToken(line));
+  TEST_ASSERT_EQUAL_STRING("", nextToken(line));
+}
+
+void test_queue_full() {
+  JobQueue queue;
+
+  for (int i = 0; i < jobQueueSize; i++) { TEST_ASSERT_TRUE(queue.push(jobDwell, i)); }
+  TEST_ASSERT_TRUE(queue.full());
+  TEST_ASSERT_FALSE(queue.push(jobDwell, 99));
+  TEST_ASSERT_EQUAL_INT(jobQueueSize, queue.count());
+  TEST_ASSERT_EQUAL_INT32(jobQueueSize - 1, queue.at(jobQueueSize - 1).arg);
+
+  queue.clear();
+  TEST_ASSERT_EQUAL_INT(0, queue.count());
+  queue.pop(); // popping an empty queue does nothing
+  TEST_ASSERT_EQUAL_INT(0, queue.count());
+}
+
+void test_queue_wrap() {
+  JobQueue queue;
+
+  // walk the head most of the way round so the next pushes wrap past the end of the buffer
+  for (int i = 0; i < jobQueueSize - 3; i++) {
+    queue.push(jobDwell, i);
+    queue.pop();
+  }
+  for (int i = 0; i < jobQueueSize; i++) { TEST_ASSERT_TRUE(queue.push(jobCross, 100 + i)); }
+  TEST_ASSERT_FALSE(queue.push(jobCross, 0));
+
+  for (int i = 0; i < jobQueueSize; i++) {
+    TEST_ASSERT_EQUAL_UINT8(jobCross, queue.at(0).type);
+    TEST_ASSERT_EQUAL_INT32(100 + i, queue.at(0).arg);
+    queue.pop();
+  }
+  TEST_ASSERT_EQUAL_INT(0, queue.count());
+}
+
+void test_merge_same_direction() {
+  JobQueue queue;
+  queue.push(jobMove, 100);
+  queue.push(jobMove, 200);
+  queue.push(jobMove, 300);
+  queue.push(jobDwell, 10);
+
+  TEST_ASSERT_EQUAL_INT32(300, mergeMoves(queue, 0));
+  TEST_ASSERT_EQUAL_INT(2, queue.count());
+  TEST_ASSERT_EQUAL_INT32(300, queue.at(0).arg);
+  TEST_ASSERT_EQUAL_UINT8(jobDwell, queue.at(1).type);
+}
+
+void test_merge_stops_on_reversal() {
+  JobQueue queue;
+  queue.push(jobMove, -100);
+  queue.push(jobMove, -200);
+  queue.push(jobMove, -50); // back the other way, has to stop first
+  queue.push(jobMove, -400);
+
+  TEST_ASSERT_EQUAL_INT32(-200, mergeMoves(queue, 0));
+  TEST_ASSERT_EQUAL_INT(3, queue.count());
+}
+
+void test_merge_keeps_stops() {
+  JobQueue queue;
+
+  // already there - no direction to carry on in
+  queue.push(jobMove, 100);
+  queue.push(jobMove, 200);
+  TEST_ASSERT_EQUAL_INT32(100, mergeMoves(queue, 100));
+  TEST_ASSERT_EQUAL_INT(2, queue.count());
+
+  // a repeated target isn't a move
+  queue.clear();
+  queue.push(jobMove, 100);
+  queue.push(jobMove, 100);
+  TEST_ASSERT_EQUAL_INT32(100, mergeMoves(queue, 0));
+  TEST_ASSERT_EQUAL_INT(2, queue.count());
+
+  // something other than a move in between
+  queue.clear();
+  queue.push(jobMove, 100);
+  queue.push(jobDwell, 500);
+  queue.push(jobMove, 200);
+  TEST_ASSERT_EQUAL_INT32(100, mergeMoves(queue, 0));
+  TEST_ASSERT_EQUAL_INT(3, queue.count());
+}
+
+int runTests() {
+  UNITY_BEGIN();
+  RUN_TEST(test_parse_fixed);
+  RUN_TEST(test_is_number);
+  RUN_TEST(test_next_token);
+  RUN_TEST(test_queue_full);
+  RUN_TEST(test_queue_wrap);
+  RUN_TEST(test_merge_same_direction);
+  RUN_TEST(test_merge_stops_on_reversal);
+  RUN_TEST(test_merge_keeps_stops);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+void setup() {
+  delay(2000); // give the usb serial time to come up
+  runTests();
+}
+
+void loop() {}
+#else
+int main() {
+  return runTests();
+}
+#endif